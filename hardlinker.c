@@ -4,25 +4,48 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/xattr.h>
+#include <time.h>
 #include <unistd.h>
 
 int usage()
 {
-    printf("hardlinker [-noxattr] <source> <destination> <reference>\n");
+    printf("hardlinker [-noxattr] [-fdmax=N] <source> <destination> <reference>\n");
     printf("           recursively copy all from <source> to <destination>\n");
     printf("           making hardlinks to <reference> wherever possible\n");
-    printf("hardlinker [-noxattr] -static <directory> <reference>\n");
+    printf("hardlinker [-noxattr] [-fdmax=N] [-sync] -static <directory> <reference>\n");
     printf("           recursively scan <directory> looking for duplicates\n");
     printf("           in <reference> and replacing them with hardlinks\n");
+    printf("hardlinker [-noxattr] [-fdmax=N] [-digest=FILE] [-jobs=N] -verify <source> <destination>\n");
+    printf("           check that <destination> matches <source>, using the digests\n");
+    printf("           recorded with -digest=FILE by the copying run\n");
+    printf("hardlinker [-noxattr] [-fdmax=N] -snapshot <reference> <file>\n");
+    printf("           record stat and xattr digests of <reference> in <file>\n");
+    printf("           for use with -refcache=<file>\n");
+    printf("  -fdmax=N keep at most N directory handles open (default: RLIMIT_NOFILE - 16)\n");
+    printf("  -digest=FILE record (copy) or load (-verify) content digests of regular files\n");
+    printf("  -jobs=N  number of -verify worker threads (default: number of CPUs)\n");
+    printf("  -refcache=FILE take reference xattrs from a -snapshot file where still valid\n");
+    printf("  -sync    in -static mode, fsync each directory after a batch of replacements\n");
+    printf("  -progress[=SOCKET] report progress and ETA on SIGUSR1 (and to clients of SOCKET)\n");
+    printf("  -total=N expected number of entries, skips the counting pass of -progress\n");
 }
 
 enum
@@ -55,16 +78,90 @@ int xattr_n_names[2];
 
 int opt_debug = 0;
 int opt_static = 0;
+int opt_verify = 0;
+int opt_snapshot = 0;
+int opt_sync = 0;
+int opt_jobs = 0;
 int opt_noxattr = 0;
 int opt_fail = 0;
 int opt_verbose = 0;
 int opt_help = 0;
 int opt_off = 0;
 int is_root = 0;
+const char * opt_digest = NULL;
+FILE * digest_file = NULL;
+const char * opt_refcache = NULL;
+
+/* directory handle budget; handles beyond it are closed and reopened on demand */
+int fd_max = 0;
+int fd_reserve = 16;
+int fd_open = 0;
+int fd_depth = 0;
 
 char compath[PATH_MAX];
 int compath_i = 0;
 
+/*
+ * Progress counters of the walking thread. They are only ever written by
+ * that thread, with plain relaxed stores, and read by the progress thread.
+ */
+struct progress
+{
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+struct progress progress_walk;
+
+#define PROGRESS_ADD(field, n) \
+    __atomic_store_n(&progress_walk.field, progress_walk.field + (n), __ATOMIC_RELAXED)
+
+/*
+ * Copy of compath for the progress thread, updated per directory under a
+ * sequence count that is odd while the walking thread changes it; the
+ * reader retries its copy until it saw the same even count on both sides.
+ */
+char progress_path[PATH_MAX];
+unsigned progress_path_seq = 0;
+
+static void progress_path_publish(int from)
+{
+    int end = compath_i < sizeof(compath) ? compath_i : sizeof(compath) - 1;
+    unsigned seq = progress_path_seq;
+    __atomic_store_n(&progress_path_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for ( int i = from; i <= end; ++i )
+    {
+        __atomic_store_n(&progress_path[i], i < end ? compath[i] : 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&progress_path_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void progress_path_read(char *path, size_t len)
+{
+    for (;;)
+    {
+        unsigned seq = __atomic_load_n(&progress_path_seq, __ATOMIC_ACQUIRE);
+        if ( seq & 1 )
+        {
+            continue;
+        }
+        for ( size_t i = 0; i < len; ++i )
+        {
+            path[i] = i < len - 1 ? __atomic_load_n(&progress_path[i], __ATOMIC_RELAXED) : 0;
+            if ( !path[i] )
+            {
+                break;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ( __atomic_load_n(&progress_path_seq, __ATOMIC_RELAXED) == seq )
+        {
+            return;
+        }
+    }
+}
+
 void debug(const char *format, ...)
 {
     if ( opt_debug )
@@ -81,6 +178,7 @@ int compath_push(const char *name)
     int frame = compath_i;
     compath_i += snprintf(compath + compath_i, sizeof(compath) - compath_i, "/%s", name);
     compath[compath_i] = 0;
+    progress_path_publish(frame);
     return frame;
 }
 
@@ -88,6 +186,7 @@ void compath_pop(int frame)
 {
     compath_i = frame;
     compath[compath_i] = 0;
+    progress_path_publish(frame);
 }
 
 void errhandle(const char *prefix, const char * fn, const char *path, int fail)
@@ -119,17 +218,211 @@ void debug_stat(int res, const struct stat *st)
     }
 }
 
-static inline int ndirfd(DIR * dir)
+/*
+ * Directory handle. Every recursion level of dive() holds up to three of
+ * them, so on deep trees the ancestors are closed when the budget (fd_max)
+ * is exhausted and reopened from their parent by name when needed again.
+ * Entries not yet read from an evicted source directory are kept in memory.
+ */
+struct dirh
+{
+    struct dirh * parent;
+    const char * name;
+    DIR * dir;
+    int depth;
+    int iter;
+    struct dirh * lru_prev;
+    struct dirh * lru_next;
+    char * rest;
+    size_t rest_len;
+    size_t rest_pos;
+    int rest_err;
+    char ent[NAME_MAX + 1];
+};
+
+struct dirh * fd_lru_head = NULL;
+struct dirh * fd_lru_tail = NULL;
+
+static void dirh_lru_unlink(struct dirh * h)
+{
+    if ( h->lru_prev )
+    {
+        h->lru_prev->lru_next = h->lru_next;
+    }
+    else
+    {
+        fd_lru_head = h->lru_next;
+    }
+    if ( h->lru_next )
+    {
+        h->lru_next->lru_prev = h->lru_prev;
+    }
+    else
+    {
+        fd_lru_tail = h->lru_prev;
+    }
+    h->lru_prev = h->lru_next = NULL;
+}
+
+static void dirh_lru_front(struct dirh * h)
+{
+    h->lru_prev = NULL;
+    h->lru_next = fd_lru_head;
+    if ( fd_lru_head )
+    {
+        fd_lru_head->lru_prev = h;
+    }
+    else
+    {
+        fd_lru_tail = h;
+    }
+    fd_lru_head = h;
+}
+
+void dirh_evict(struct dirh * h)
+{
+    if ( h->iter && !h->rest )
+    {
+        size_t cap = 4096;
+        h->rest = malloc(cap);
+        h->rest_len = 0;
+        h->rest_pos = 0;
+        h->rest_err = 0;
+        struct dirent *dent;
+        while ( errno = 0, (dent = readdir(h->dir)) != NULL )
+        {
+            size_t len = strlen(dent->d_name) + 1;
+            if ( h->rest_len + len > cap )
+            {
+                cap *= 2;
+                h->rest = realloc(h->rest, cap);
+            }
+            memcpy(h->rest + h->rest_len, dent->d_name, len);
+            h->rest_len += len;
+        }
+        h->rest_err = errno;
+    }
+    debug("evict %s (depth %d)\n", h->name, h->depth);
+    dirh_lru_unlink(h);
+    closedir(h->dir);
+    h->dir = NULL;
+    --fd_open;
+}
+
+/* make room for one more handle, never touching the current level or keep */
+void dirh_reserve(struct dirh * keep)
+{
+    struct dirh * h = fd_lru_tail;
+    while ( fd_open >= fd_max && h )
+    {
+        struct dirh * prev = h->lru_prev;
+        if ( h != keep && h->depth < fd_depth )
+        {
+            dirh_evict(h);
+        }
+        h = prev;
+    }
+}
+
+static int dirh_attach(struct dirh * h, int fd)
+{
+    h->dir = fdopendir(fd);
+    if ( !h->dir )
+    {
+        close(fd);
+        return -1;
+    }
+    ++fd_open;
+    dirh_lru_front(h);
+    return 0;
+}
+
+static int dirh_reopen(struct dirh * h);
+
+static inline int ndirfd(struct dirh * h)
+{
+    if ( !h )
+    {
+        return AT_FDCWD;
+    }
+    if ( !h->dir && dirh_reopen(h) )
+    {
+        return -1;
+    }
+    if ( h != fd_lru_head )
+    {
+        dirh_lru_unlink(h);
+        dirh_lru_front(h);
+    }
+    return dirfd(h->dir);
+}
+
+static int dirh_reopen(struct dirh * h)
+{
+    int pfd = ndirfd(h->parent);
+    dirh_reserve(h->parent);
+    debug("reopen %s (depth %d)\n", h->name, h->depth);
+    /* roots are opened by path and may be symlinks, like on the first open */
+    int fd = openat(pfd, h->name, O_RDONLY | O_DIRECTORY | (h->parent ? O_NOFOLLOW : 0));
+    if ( fd == -1 )
+    {
+        errhandle("", "reopen", h->name, FAIL_MUST);
+        return -1;
+    }
+    return dirh_attach(h, fd);
+}
+
+const char * dirh_readdir(struct dirh * h)
+{
+    const char * name;
+    errno = 0;
+    if ( h->rest )
+    {
+        if ( h->rest_pos >= h->rest_len )
+        {
+            errno = h->rest_err;
+            return NULL;
+        }
+        name = h->rest + h->rest_pos;
+        h->rest_pos += strlen(name) + 1;
+    }
+    else
+    {
+        /* a handle evicted before its iteration started is simply reopened */
+        if ( !h->dir && ndirfd(h) < 0 )
+        {
+            return NULL;
+        }
+        struct dirent *dent = readdir(h->dir);
+        if ( !dent )
+        {
+            return NULL;
+        }
+        name = dent->d_name;
+    }
+    strcpy(h->ent, name);
+    return h->ent;
+}
+
+void dirh_close(struct dirh * h)
 {
-    return dir ? dirfd(dir) : AT_FDCWD;
+    if ( h->dir )
+    {
+        dirh_lru_unlink(h);
+        closedir(h->dir);
+        h->dir = NULL;
+        --fd_open;
+    }
+    free(h->rest);
+    h->rest = NULL;
 }
 
-int wrap_stat(DIR * dir, const char *name, struct stat *st)
+int wrap_stat(struct dirh * dir, const char *name, struct stat *st)
 {
     return fstatat(ndirfd(dir), name, st, AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW) == 0 ? 0 : errno;
 }
 
-int wrap_open(const char *prefix, DIR * dir, const char *name, int mode, int fail)
+int wrap_open(const char *prefix, struct dirh * dir, const char *name, int mode, int fail)
 {
     int fd = openat(ndirfd(dir), name, mode);
     if ( fd == -1 )
@@ -139,7 +432,7 @@ int wrap_open(const char *prefix, DIR * dir, const char *name, int mode, int fai
     return fd;
 }
 
-int wrap_creat(const char *prefix, DIR * dir, const char *name, mode_t mode)
+int wrap_creat(const char *prefix, struct dirh * dir, const char *name, mode_t mode)
 {
     int fd = openat(ndirfd(dir), name, O_WRONLY | O_TRUNC | O_CREAT, mode);
     if ( fd == -1 )
@@ -149,29 +442,40 @@ int wrap_creat(const char *prefix, DIR * dir, const char *name, mode_t mode)
     return fd;
 }
 
-DIR *wrap_opendir_root(const char *path)
+struct dirh *wrap_opendir_root(struct dirh * h, const char *path)
 {
-    DIR *ret = opendir(path);
-    if (!ret)
+    memset(h, 0, sizeof(*h));
+    h->name = path;
+    dirh_reserve(NULL);
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || dirh_attach(h, fd))
     {
         errhandle("", "opendir", path, FAIL_MUST);
+        return NULL;
     }
-    return ret;
+    return h;
 }
 
-DIR *wrap_opendir(const char *prefix, DIR * dir, const char *path)
+struct dirh *wrap_opendir(const char *prefix, struct dirh * h, struct dirh * dir, const char *path)
 {
-    int fd = wrap_open(prefix, dir, path, O_RDONLY, FAIL_OPENDIR);
+    memset(h, 0, sizeof(*h));
+    h->parent = dir;
+    h->name = path;
+    h->depth = dir ? dir->depth + 1 : 0;
+    int pfd = ndirfd(dir);
+    dirh_reserve(dir);
+    int fd = openat(pfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
     if (fd == -1)
     {
+        errhandle(prefix, "open", path, FAIL_OPENDIR);
         return NULL;
     }
-    DIR *ret = fdopendir(fd);
-    if (!ret)
+    if (dirh_attach(h, fd))
     {
         errhandle(prefix, "opendir", path, FAIL_OPENDIR);
+        return NULL;
     }
-    return ret;
+    return h;
 }
 
 void *wrap_mmap(const char *prefix, size_t size, int fd, off_t offset, const char *name)
@@ -185,7 +489,7 @@ void *wrap_mmap(const char *prefix, size_t size, int fd, off_t offset, const cha
     return ret;
 }
 
-int wrap_link(const char *prefix, DIR * src_dir, DIR * dst_dir, const char *name)
+int wrap_link(const char *prefix, struct dirh * src_dir, struct dirh * dst_dir, const char *name)
 {
     int result = linkat(ndirfd(src_dir), name, ndirfd(dst_dir), name, 0);
     if ( result == -1 )
@@ -195,7 +499,35 @@ int wrap_link(const char *prefix, DIR * src_dir, DIR * dst_dir, const char *name
     return result;
 }
 
-int wrap_mkdir_p(const char *prefix, DIR * dir, const char *name, mode_t mode)
+/* replace name in dir with a hardlink to name in src_dir, atomically for readers */
+int wrap_replace(const char *prefix, struct dirh * src_dir, struct dirh * dir, const char *name)
+{
+    static unsigned long serial = 0;
+    char tmp[64];
+    int result;
+    int src_fd = ndirfd(src_dir);
+    int fd = ndirfd(dir);
+    do
+    {
+        snprintf(tmp, sizeof(tmp), ".hardlinker.%d.%lu", (int)getpid(), serial++);
+        result = linkat(src_fd, name, fd, tmp, 0);
+    }
+    while ( result == -1 && errno == EEXIST );
+    if ( result == -1 )
+    {
+        errhandle(prefix, "link", name, FAIL_HL);
+        return result;
+    }
+    result = renameat(fd, tmp, fd, name);
+    if ( result == -1 )
+    {
+        errhandle(prefix, "rename", name, FAIL_HL);
+        unlinkat(fd, tmp, 0);
+    }
+    return result;
+}
+
+int wrap_mkdir_p(const char *prefix, struct dirh * dir, const char *name, mode_t mode)
 {
     int result = mkdirat(ndirfd(dir), name, mode);
     if ( result == -1 )
@@ -213,7 +545,7 @@ int wrap_mkdir_p(const char *prefix, DIR * dir, const char *name, mode_t mode)
     return result;
 }
 
-int wrap_mknod(const char *prefix, DIR * dir, const char *name, mode_t mode, dev_t dev)
+int wrap_mknod(const char *prefix, struct dirh * dir, const char *name, mode_t mode, dev_t dev)
 {
     int result = mknodat(ndirfd(dir), name, mode, dev);
     if ( result == -1 )
@@ -223,7 +555,7 @@ int wrap_mknod(const char *prefix, DIR * dir, const char *name, mode_t mode, dev
     return result;
 }
 
-int wrap_readlink(const char *prefix, DIR * dir, const char *name, char * buf, size_t bufsize)
+int wrap_readlink(const char *prefix, struct dirh * dir, const char *name, char * buf, size_t bufsize)
 {
     int result = readlinkat(ndirfd(dir), name, buf, bufsize);
     if ( result == -1 )
@@ -241,7 +573,7 @@ int wrap_readlink(const char *prefix, DIR * dir, const char *name, char * buf, s
     return result;
 }
 
-int wrap_symlink(const char *prefix, const char * target, DIR * dir, const char *name)
+int wrap_symlink(const char *prefix, const char * target, struct dirh * dir, const char *name)
 {
     int result = symlinkat(target, ndirfd(dir), name);
     if ( result == -1 )
@@ -251,16 +583,6 @@ int wrap_symlink(const char *prefix, const char * target, DIR * dir, const char
     return result;
 }
 
-int wrap_remove(const char *prefix, DIR * dir, const char *name)
-{
-    int result = unlinkat(ndirfd(dir), name, 0);
-    if ( result == -1 )
-    {
-        errhandle(prefix, "unlink", name, FAIL_MUST);
-    }
-    return result;
-}
-
 int void_strcmp(const void *a, const void *b)
 {
     return strcmp((const char*)a, (const char*)b);
@@ -328,7 +650,7 @@ int cmp_xattr_values(const char *prefix, int src_fd, int ref_fd)
     return 0;
 }
 
-int transfer_mode(const char *prefix, const struct stat * st, DIR * dir, const char * name)
+int transfer_mode(const char *prefix, const struct stat * st, struct dirh * dir, const char * name)
 {
     if (S_ISLNK(st->st_mode))
     {
@@ -343,7 +665,7 @@ int transfer_mode(const char *prefix, const struct stat * st, DIR * dir, const c
     return result;
 }
 
-int transfer_owner(const char *prefix, const struct stat * st, DIR * dir, const char * name)
+int transfer_owner(const char *prefix, const struct stat * st, struct dirh * dir, const char * name)
 {
     int result;
     result = fchownat(ndirfd(dir), name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
@@ -354,339 +676,1990 @@ int transfer_owner(const char *prefix, const struct stat * st, DIR * dir, const
     return result;
 }
 
-int diff_content(DIR * src_dir, DIR * ref_dir, const char *name, size_t size)
+/*
+ * Content digest, XXH64 with seed 0, computed incrementally so that it can
+ * be fed with the data as it is being copied.
+ */
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3  1609587929392839161ULL
+#define XXH_P4  9650029242287828579ULL
+#define XXH_P5  2870177450012600261ULL
+
+struct digest
 {
-    int ret = 0;
-    int src_fd = wrap_open(src_path, src_dir, name, O_RDONLY, FAIL_DIFF);
-    if ( src_fd < 0 )
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buf[32];
+    unsigned buf_len;
+};
+
+static inline uint64_t xxh_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v)
+{
+    acc ^= xxh_round(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static inline uint64_t xxh_read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxh_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+void digest_init(struct digest *d)
+{
+    d->v[0] = XXH_P1 + XXH_P2;
+    d->v[1] = XXH_P2;
+    d->v[2] = 0;
+    d->v[3] = -XXH_P1;
+    d->total = 0;
+    d->buf_len = 0;
+}
+
+static inline void digest_stripe(struct digest *d, const unsigned char *p)
+{
+    d->v[0] = xxh_round(d->v[0], xxh_read64(p));
+    d->v[1] = xxh_round(d->v[1], xxh_read64(p + 8));
+    d->v[2] = xxh_round(d->v[2], xxh_read64(p + 16));
+    d->v[3] = xxh_round(d->v[3], xxh_read64(p + 24));
+}
+
+void digest_update(struct digest *d, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    d->total += len;
+    if ( d->buf_len )
     {
-        ret |= 8;
-        goto fail_src_fd;
+        size_t fill = 32 - d->buf_len;
+        if ( len < fill )
+        {
+            memcpy(d->buf + d->buf_len, p, len);
+            d->buf_len += len;
+            return;
+        }
+        memcpy(d->buf + d->buf_len, p, fill);
+        digest_stripe(d, d->buf);
+        d->buf_len = 0;
+        p += fill;
+        len -= fill;
     }
-    int ref_fd = wrap_open(ref_path, ref_dir, name, O_RDONLY, FAIL_DIFF);
-    if ( ref_fd < 0 )
+    while ( len >= 32 )
     {
-        ret |= 8;
-        goto fail_ref_fd;
+        digest_stripe(d, p);
+        p += 32;
+        len -= 32;
     }
-    if ( size )
+    memcpy(d->buf, p, len);
+    d->buf_len = len;
+}
+
+uint64_t digest_final(const struct digest *d)
+{
+    uint64_t h;
+    if ( d->total >= 32 )
     {
-        void * src_map = wrap_mmap(src_path, size, src_fd, 0, name);
-        if ( src_map == MAP_FAILED )
-        {
-            ret |= 8;
-            goto fail_src_map;
-        }
-        void * ref_map = wrap_mmap(ref_path, size, ref_fd, 0, name);
-        if ( ref_map == MAP_FAILED )
+        h = xxh_rotl(d->v[0], 1) + xxh_rotl(d->v[1], 7) + xxh_rotl(d->v[2], 12) + xxh_rotl(d->v[3], 18);
+        for ( int i = 0; i < 4; ++i )
         {
-            ret |= 8;
-            goto fail_ref_map;
+            h = xxh_merge(h, d->v[i]);
         }
-        if ( memcmp(src_map, ref_map, size) )
-        {
-            ret |= 1;
-        }
-        munmap(ref_map, size);
-fail_ref_map:
-        munmap(src_map, size);
-fail_src_map:
-        ;
     }
-    while(!opt_noxattr)
+    else
     {
-        load_xattr_names(src_path, src_fd, 0);
-        load_xattr_names(ref_path, ref_fd, 1);
-        if (cmp_xattr_names())
-        {
-            ret |= 2;
-            break;
-        }
-        if (cmp_xattr_values(src_path, src_fd, ref_fd))
-        {
-            ret |= 4;
-            break;
-        }
-        break;
+        h = XXH_P5;
     }
+    h += d->total;
+    const unsigned char *p = d->buf;
+    unsigned len = d->buf_len;
+    for ( ; len >= 8; p += 8, len -= 8 )
+    {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if ( len >= 4 )
+    {
+        h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+        h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    for ( ; len > 0; ++p, --len )
+    {
+        h ^= *p * XXH_P5;
+        h = xxh_rotl(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
 
-    close(ref_fd);
-fail_ref_fd:
-    close(src_fd);
-fail_src_fd:
-    return ret;
+uint64_t digest_buf(const void *data, size_t len)
+{
+    struct digest d;
+    digest_init(&d);
+    digest_update(&d, data, len);
+    return digest_final(&d);
 }
 
-void transfer_xattr(DIR * src_dir, DIR * dst_dir, const char *src_name, const char *dst_name)
+/*
+ * digest records are "<16 hex digits> <ino> <size> <mtime> <ctime> <path
+ * below root>", NUL terminated, with the state of the destination file once
+ * it is complete, so that -verify can tell whether it was touched since.
+ */
+void digest_record(struct dirh * dst_dir, const char *name, uint64_t digest)
 {
-    int src_fd = wrap_open(src_path, src_dir, src_name, O_RDONLY, 0);
-    if ( src_fd < 0 )
+    struct stat st;
+    if ( !digest_file )
     {
-        goto fail_src_fd;
+        return;
     }
-    int dst_fd = wrap_open(dst_path, dst_dir, dst_name, O_RDONLY, 0);
-    if ( dst_fd < 0 )
+    if ( wrap_stat(dst_dir, name, &st) )
     {
-        goto fail_dst_fd;
+        /* without a record, -verify reads the destination */
+        return;
     }
-    load_xattr_names(src_path, src_fd, 0);
-    int n = xattr_n_names[0];
-    int result;
-    for ( int i = 0; i < n; ++i )
+    fprintf(digest_file, "%016llx %llu %lld %lld.%09ld %lld.%09ld %s/%s%c", (unsigned long long)digest,
+            (unsigned long long)st.st_ino, (long long)st.st_size,
+            (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+            (long long)st.st_ctim.tv_sec, st.st_ctim.tv_nsec, compath, name, 0);
+}
+
+int diff_xattr(const char *src_prefix, int src_fd, const char *ref_prefix, int ref_fd)
+{
+    load_xattr_names(src_prefix, src_fd, 0);
+    load_xattr_names(ref_prefix, ref_fd, 1);
+    if (cmp_xattr_names())
     {
-        const char * key = xattr_pname_buf[0][i];
-        result = fgetxattr(src_fd, key, xattr_value_buf[0], xattr_max);
-        if (result == -1)
+        return 2;
+    }
+    if (cmp_xattr_values(src_prefix, src_fd, ref_fd))
+    {
+        return 4;
+    }
+    return 0;
+}
+
+/* digest of all xattrs of fd, in name order, loaded into buffer set reg */
+uint64_t xattr_digest(const char *prefix, int fd, int reg)
+{
+    struct digest d;
+    digest_init(&d);
+    load_xattr_names(prefix, fd, reg);
+    for ( int i = 0; i < xattr_n_names[reg]; ++i )
+    {
+        const char * key = xattr_pname_buf[reg][i];
+        int32_t result = fgetxattr(fd, key, xattr_value_buf[reg], xattr_max);
+        if ( result < 0 )
         {
-            errhandle(src_path, "fgetxattr", src_name, FAIL_XATTR);
+            errhandle(prefix, "getxattr", "", FAIL_XATTR);
             continue;
         }
-        result = fsetxattr(dst_fd, key, xattr_value_buf[0], result, 0);
-        if (result == -1)
+        digest_update(&d, key, strlen(key) + 1);
+        digest_update(&d, &result, sizeof(result));
+        digest_update(&d, xattr_value_buf[reg], result);
+    }
+    return digest_final(&d);
+}
+
+/*
+ * Reference snapshot, written by -snapshot and mapped by -refcache: a
+ * header, the entries for regular files sorted by path, then the paths.
+ * An entry is used only while the inode number and ctime of the reference
+ * file still match, i.e. nothing about the file has changed since. That
+ * includes new links to it, so files linked to by a run are read again
+ * by the next one. The mapping is read-only, and -snapshot replaces the
+ * file by rename, so runs still using the old snapshot are not disturbed.
+ */
+#define SNAP_MAGIC "HLSNAP1"
+#define SNAP_XATTR 1
+
+struct snap_header
+{
+    char magic[8];
+    uint32_t flags;
+    uint32_t entry_size;
+    uint64_t root_dev;
+    uint64_t root_ino;
+    uint64_t count;
+};
+
+struct snap_entry
+{
+    uint64_t path_off;
+    uint64_t ino;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t mode;
+    uint32_t pad;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t xattr_digest;
+};
+
+const struct snap_header * snap = NULL;
+const struct snap_entry * snap_entries = NULL;
+const char * snap_paths = NULL;
+
+struct snap_entry * snap_build = NULL;
+size_t snap_build_n = 0;
+size_t snap_build_cap = 0;
+char * snap_build_paths = NULL;
+size_t snap_build_paths_len = 0;
+size_t snap_build_paths_cap = 0;
+
+void snapshot_add(struct dirh * dir, const char *name, const struct stat *st)
+{
+    if ( snap_build_n == snap_build_cap )
+    {
+        snap_build_cap = snap_build_cap ? snap_build_cap * 2 : 1024;
+        snap_build = realloc(snap_build, snap_build_cap * sizeof(*snap_build));
+    }
+    size_t len = compath_i + strlen(name) + 2;
+    while ( snap_build_paths_len + len > snap_build_paths_cap )
+    {
+        snap_build_paths_cap = snap_build_paths_cap ? snap_build_paths_cap * 2 : 65536;
+        snap_build_paths = realloc(snap_build_paths, snap_build_paths_cap);
+    }
+    struct snap_entry * e = &snap_build[snap_build_n];
+    memset(e, 0, sizeof(*e));
+    e->path_off = snap_build_paths_len;
+    sprintf(snap_build_paths + snap_build_paths_len, "%s/%s", compath, name);
+    e->ino = st->st_ino;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    e->mode = st->st_mode;
+    e->size = st->st_size;
+    e->mtime_sec = st->st_mtim.tv_sec;
+    e->mtime_nsec = st->st_mtim.tv_nsec;
+    e->ctime_sec = st->st_ctim.tv_sec;
+    e->ctime_nsec = st->st_ctim.tv_nsec;
+    if ( !opt_noxattr )
+    {
+        int fd = wrap_open(ref_path, dir, name, O_RDONLY, FAIL_XATTR);
+        if ( fd < 0 )
         {
-            errhandle(dst_path, "fsetxattr", dst_name, FAIL_XATTR);
+            return;
         }
+        e->xattr_digest = xattr_digest(ref_path, fd, 1);
+        close(fd);
     }
-    close(dst_fd);
-fail_dst_fd:
-    close(src_fd);
-fail_src_fd:
-    ;
+    snap_build_paths_len += len;
+    ++snap_build_n;
 }
 
-void copy_file(DIR * src_dir, DIR * dst_dir, const char *name, size_t size, mode_t mode)
+void snapshot_walk(struct dirh * dir)
 {
-    int dst_fd = wrap_creat(dst_path, dst_dir, name, mode);
-    if ( dst_fd != -1 && size != 0 )
+    const char * name;
+    dir->iter = 1;
+    while ( fd_depth = dir->depth, (name = dirh_readdir(dir)) != NULL)
     {
-        int src_fd = wrap_open(src_path, src_dir, name, O_RDONLY, FAIL_COPY);
-        if ( src_fd == -1 )
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
         {
-            goto fail_src_fd;
+            continue;
         }
-        void * src_map = wrap_mmap(src_path, size, src_fd, 0, name);
-        if ( src_map == MAP_FAILED )
+        struct stat st[1];
+        if ( wrap_stat(dir, name, st) )
         {
-            goto fail_src_map;
+            continue;
         }
-        size_t left = size;
-        char * p = src_map;
-        while ( left )
+        PROGRESS_ADD(entries, 1);
+        if ( S_ISREG(st->st_mode) )
         {
-            ssize_t readsize = write(dst_fd, p, left);
-            if ( readsize <= 0 )
+            snapshot_add(dir, name, st);
+        }
+        else if ( S_ISDIR(st->st_mode) )
+        {
+            struct dirh nx_h;
+            struct dirh * nx_dir = wrap_opendir(ref_path, &nx_h, dir, name);
+            if ( nx_dir )
             {
-                errhandle(dst_path, "write", name, FAIL_COPY);
-                break;
+                int frame = compath_push(name);
+                snapshot_walk(nx_dir);
+                compath_pop(frame);
+                dirh_close(nx_dir);
             }
-            left -= readsize;
-            p += readsize;
         }
-        munmap(src_map, size);
-fail_src_map:
-        close(src_fd);
-fail_src_fd:
-        ;
     }
-    close(dst_fd);
+    if (errno != 0)
+    {
+        fprintf(stderr, "ERROR: READDIR: {ref}%s: %s\n", compath, strerror(errno));
+        exit(1);
+    }
 }
 
-void dive(DIR * src_dir, DIR * dst_dir, DIR * ref_dir)
+int snap_build_cmp(const void *a, const void *b)
 {
-    struct dirent *dent;
-    while ( errno = 0, (dent = readdir(src_dir)) != NULL)
+    return strcmp(snap_build_paths + ((const struct snap_entry *)a)->path_off,
+                  snap_build_paths + ((const struct snap_entry *)b)->path_off);
+}
+
+void snapshot_write(const char *path, const struct stat *root)
+{
+    qsort(snap_build, snap_build_n, sizeof(*snap_build), snap_build_cmp);
+    struct snap_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    h.flags = opt_noxattr ? 0 : SNAP_XATTR;
+    h.entry_size = sizeof(struct snap_entry);
+    h.root_dev = root->st_dev;
+    h.root_ino = root->st_ino;
+    h.count = snap_build_n;
+    char tmp[PATH_MAX];
+    if ( snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid()) >= sizeof(tmp) )
     {
-        const char * name = dent->d_name;
-        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        errno = ENAMETOOLONG;
+        errhandle("", "open", path, FAIL_MUST);
+        return;
+    }
+    FILE * f = fopen(tmp, "wx");
+    if ( !f )
+    {
+        errhandle("", "open", tmp, FAIL_MUST);
+        return;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(snap_build, sizeof(*snap_build), snap_build_n, f);
+    fwrite(snap_build_paths, 1, snap_build_paths_len, f);
+    if ( fclose(f) )
+    {
+        errhandle("", "write", tmp, FAIL_MUST);
+        unlink(tmp);
+        return;
+    }
+    if ( rename(tmp, path) == -1 )
+    {
+        errhandle("", "rename", tmp, FAIL_MUST);
+        unlink(tmp);
+    }
+}
+
+/* check that the header, the entries and every path lie within size bytes */
+int snapshot_valid(const struct snap_header *h, size_t size)
+{
+    if ( memcmp(h->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) || h->entry_size != sizeof(struct snap_entry) )
+    {
+        return 0;
+    }
+    if ( h->count > (size - sizeof(*h)) / sizeof(struct snap_entry) )
+    {
+        return 0;
+    }
+    const struct snap_entry * entries = (const struct snap_entry *)(h + 1);
+    const char * paths = (const char *)(entries + h->count);
+    size_t paths_len = size - sizeof(*h) - h->count * sizeof(struct snap_entry);
+    if ( h->count && (!paths_len || paths[paths_len - 1]) )
+    {
+        return 0;
+    }
+    for ( uint64_t i = 0; i < h->count; ++i )
+    {
+        if ( entries[i].path_off >= paths_len )
         {
-            continue;
+            return 0;
         }
-        
-        struct stat src_stat[1];
-        struct stat ref_stat[1];
-        int src_stat_res;
-        int ref_stat_res;
+    }
+    return 1;
+}
 
-        src_stat_res = wrap_stat(src_dir, name, src_stat);
-        if ( src_stat_res )
+/* map a snapshot of the reference rooted at root, silently ignoring unusable ones */
+void snapshot_load(const char *path, const struct stat *root)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ( fd == -1 || fstat(fd, &st) )
+    {
+        errhandle("", "open", path, FAIL_MUST);
+        return;
+    }
+    const struct snap_header * h = NULL;
+    if ( st.st_size >= sizeof(*h) )
+    {
+        h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if ( h == MAP_FAILED )
         {
-            continue;
+            errhandle("", "mmap", path, FAIL_MMAP);
         }
-        if ( ref_dir )
+    }
+    close(fd);
+    if ( !h || h == MAP_FAILED )
+    {
+        return;
+    }
+    if ( !snapshot_valid(h, st.st_size) || (!opt_noxattr && !(h->flags & SNAP_XATTR)) )
+    {
+        fprintf(stderr, "%s: not a usable snapshot, ignored\n", path);
+        munmap((void *)h, st.st_size);
+        return;
+    }
+    if ( h->root_dev != root->st_dev || h->root_ino != root->st_ino )
+    {
+        fprintf(stderr, "%s: snapshot of a different reference, ignored\n", path);
+        munmap((void *)h, st.st_size);
+        return;
+    }
+    snap = h;
+    snap_entries = (const struct snap_entry *)(h + 1);
+    snap_paths = (const char *)(snap_entries + h->count);
+}
+
+const struct snap_entry * snapshot_lookup(const char *name)
+{
+    if ( !snap )
+    {
+        return NULL;
+    }
+    char path[PATH_MAX];
+    if ( snprintf(path, sizeof(path), "%s/%s", compath, name) >= sizeof(path) )
+    {
+        return NULL;
+    }
+    size_t lo = 0;
+    size_t hi = snap->count;
+    while ( lo < hi )
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(path, snap_paths + snap_entries[mid].path_off);
+        if ( c == 0 )
         {
-            ref_stat_res = wrap_stat(ref_dir, name, ref_stat);
+            return &snap_entries[mid];
+        }
+        if ( c < 0 )
+        {
+            hi = mid;
         }
         else
         {
-            ref_stat_res = ENOENT;
+            lo = mid + 1;
         }
+    }
+    return NULL;
+}
 
-        if ( opt_debug )
+static int snapshot_matches(const struct snap_entry *e, const struct stat *st)
+{
+    return e->ino == st->st_ino && e->ctime_sec == st->st_ctim.tv_sec && e->ctime_nsec == st->st_ctim.tv_nsec;
+}
+
+const struct snap_entry * snapshot_find(const char *name, const struct stat *st)
+{
+    const struct snap_entry * e = snapshot_lookup(name);
+    return e && snapshot_matches(e, st) ? e : NULL;
+}
+
+/*
+ * Content/xattr comparison of two regular files with equal stat is a set
+ * of mismatch predicates. They are ordered per file by expected cost per
+ * rejection, learnt from the run so far, so that whichever check has
+ * been cheapest at telling files apart runs first. A file is equal only
+ * if every predicate passes.
+ */
+struct cmp_ctx
+{
+    const char * name;
+    size_t size;
+    int src_fd;
+    int ref_fd;
+    void * src_map;
+    void * ref_map;
+    int xattr_loaded;
+    int content_done;
+    int noop;
+    const struct snap_entry * cached;
+    uint64_t * digest;
+};
+
+struct cmp_pred
+{
+    const char * name;
+    int (*check)(struct cmp_ctx *);
+    int xattr;
+    int per_page;
+    double cost;
+    long runs;
+    long rejects;
+    double time;
+};
+
+static int cmp_map(struct cmp_ctx *c)
+{
+    if ( !c->src_map )
+    {
+        c->src_map = wrap_mmap(src_path, c->size, c->src_fd, 0, c->name);
+        if ( c->src_map == MAP_FAILED )
         {
-            debug_stat(src_stat_res, src_stat);
-            debug_stat(ref_stat_res, ref_stat);
-            debug(" %-40s %-40s", compath, name);
+            c->src_map = NULL;
+            return 8;
+        }
+    }
+    if ( !c->ref_map )
+    {
+        c->ref_map = wrap_mmap(ref_path, c->size, c->ref_fd, 0, c->name);
+        if ( c->ref_map == MAP_FAILED )
+        {
+            c->ref_map = NULL;
+            return 8;
         }
+    }
+    return 0;
+}
 
-        int diff = 0;
-        int hl = 0;
-        int dc;
+static int cmp_xattr_load(struct cmp_ctx *c)
+{
+    if ( !c->xattr_loaded )
+    {
+        load_xattr_names(src_path, c->src_fd, 0);
+        load_xattr_names(ref_path, c->ref_fd, 1);
+        c->xattr_loaded = 1;
+    }
+    return cmp_xattr_names() ? 2 : 0;
+}
 
-        if ( !S_ISREG(src_stat->st_mode) )
+int pred_xattr_names(struct cmp_ctx *c)
+{
+    if ( c->cached )
+    {
+        c->noop = 1;
+        return 0;
+    }
+    return cmp_xattr_load(c);
+}
+
+int pred_xattr_values(struct cmp_ctx *c)
+{
+    if ( c->cached )
+    {
+        return xattr_digest(src_path, c->src_fd, 0) != c->cached->xattr_digest ? 4 : 0;
+    }
+    int ret = cmp_xattr_load(c);
+    if ( !ret && cmp_xattr_values(src_path, c->src_fd, c->ref_fd) )
+    {
+        ret = 4;
+    }
+    return ret;
+}
+
+int pred_head_tail(struct cmp_ctx *c)
+{
+    const size_t block = 4096;
+    if ( c->content_done || c->size <= 2 * block )
+    {
+        c->noop = 1;
+        return 0;
+    }
+    int ret = cmp_map(c);
+    if ( ret )
+    {
+        return ret;
+    }
+    size_t tail = c->size - block;
+    if ( memcmp(c->src_map, c->ref_map, block) || memcmp((char *)c->src_map + tail, (char *)c->ref_map + tail, block) )
+    {
+        return 1;
+    }
+    return 0;
+}
+
+int pred_content(struct cmp_ctx *c)
+{
+    c->content_done = 1;
+    if ( !c->size )
+    {
+        if ( c->digest )
         {
-            debug(" noreg\n");
-            diff = 1;
+            *c->digest = digest_buf(NULL, 0);
         }
-        else if ( ref_stat_res )
+        return 0;
+    }
+    int ret = cmp_map(c);
+    if ( ret )
+    {
+        return ret;
+    }
+    if ( memcmp(c->src_map, c->ref_map, c->size) )
+    {
+        return 1;
+    }
+    if ( c->digest )
+    {
+        *c->digest = digest_buf(c->src_map, c->size);
+    }
+    return 0;
+}
+
+/* initial cost guesses in ns, per call or per 4 KiB page */
+struct cmp_pred cmp_preds[] =
+{
+    { "xattr_names",  pred_xattr_names,  1, 0,  2000 },
+    { "xattr_values", pred_xattr_values, 1, 0,  4000 },
+    { "head_tail",    pred_head_tail,    0, 0, 10000 },
+    { "content",      pred_content,      0, 1,  1000 },
+};
+#define N_CMP_PREDS ((int)(sizeof(cmp_preds) / sizeof(cmp_preds[0])))
+
+static double pred_score(const struct cmp_pred *p, size_t size)
+{
+    double cost = p->per_page ? p->cost * (size / 4096 + 1) : p->cost;
+    return cost * (p->runs + 2) / (p->rejects + 1);
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int diff_content(struct dirh * src_dir, struct dirh * ref_dir, const char *name, const struct stat *ref_stat, uint64_t *digest)
+{
+    struct cmp_ctx c;
+    memset(&c, 0, sizeof(c));
+    c.name = name;
+    c.size = ref_stat->st_size;
+    c.digest = digest;
+    int ret = 0;
+    c.src_fd = wrap_open(src_path, src_dir, name, O_RDONLY, FAIL_DIFF);
+    if ( c.src_fd < 0 )
+    {
+        ret |= 8;
+        goto fail_src_fd;
+    }
+    c.ref_fd = wrap_open(ref_path, ref_dir, name, O_RDONLY, FAIL_DIFF);
+    if ( c.ref_fd < 0 )
+    {
+        ret |= 8;
+        goto fail_ref_fd;
+    }
+    if ( !opt_noxattr )
+    {
+        c.cached = snapshot_find(name, ref_stat);
+    }
+
+    int order[N_CMP_PREDS];
+    double score[N_CMP_PREDS];
+    for ( int i = 0; i < N_CMP_PREDS; ++i )
+    {
+        double sc = pred_score(&cmp_preds[i], c.size);
+        int j = i;
+        for ( ; j > 0 && score[j - 1] > sc; --j )
         {
-            debug(" ref_stat_res\n");
-            diff = 1;
+            order[j] = order[j - 1];
+            score[j] = score[j - 1];
         }
-        else if ( src_stat->st_uid != ref_stat->st_uid )
+        order[j] = i;
+        score[j] = sc;
+    }
+    for ( int i = 0; i < N_CMP_PREDS && !ret; ++i )
+    {
+        struct cmp_pred * p = &cmp_preds[order[i]];
+        if ( p->xattr && opt_noxattr )
         {
-            debug(" st_uid\n");
-            diff = 1;
+            continue;
         }
-        else if ( src_stat->st_gid != ref_stat->st_gid )
+        double t = now_ns();
+        c.noop = 0;
+        ret |= p->check(&c);
+        t = now_ns() - t;
+        if ( c.noop )
         {
-            debug(" st_gid\n");
-            diff = 1;
+            /* nothing was checked, so nothing was learnt about the cost */
+            continue;
         }
-        else if ( src_stat->st_mode != ref_stat->st_mode )
+        ++p->runs;
+        p->rejects += ret != 0;
+        p->time += t;
+        if ( p->per_page )
         {
-            debug(" st_mode\n");
-            diff = 1;
+            t /= c.size / 4096 + 1;
         }
-        else if ( src_stat->st_size != ref_stat->st_size )
+        p->cost += (t - p->cost) / 8;
+    }
+
+    if ( c.ref_map )
+    {
+        munmap(c.ref_map, c.size);
+    }
+    if ( c.src_map )
+    {
+        munmap(c.src_map, c.size);
+    }
+    close(c.ref_fd);
+fail_ref_fd:
+    close(c.src_fd);
+fail_src_fd:
+    return ret;
+}
+
+void cmp_stats()
+{
+    fprintf(stderr, "%-14s %10s %10s %12s\n", "predicate", "runs", "rejects", "avg ns");
+    for ( int i = 0; i < N_CMP_PREDS; ++i )
+    {
+        const struct cmp_pred * p = &cmp_preds[i];
+        fprintf(stderr, "%-14s %10ld %10ld %12.0f\n", p->name, p->runs, p->rejects, p->runs ? p->time / p->runs : 0.0);
+    }
+}
+
+void transfer_xattr_fd(int src_fd, int dst_fd, const char *src_name, const char *dst_name)
+{
+    load_xattr_names(src_path, src_fd, 0);
+    int n = xattr_n_names[0];
+    int result;
+    for ( int i = 0; i < n; ++i )
+    {
+        const char * key = xattr_pname_buf[0][i];
+        result = fgetxattr(src_fd, key, xattr_value_buf[0], xattr_max);
+        if (result == -1)
         {
-            debug(" st_size\n");
-            diff = 1;
+            errhandle(src_path, "fgetxattr", src_name, FAIL_XATTR);
+            continue;
+        }
+        result = fsetxattr(dst_fd, key, xattr_value_buf[0], result, 0);
+        if (result == -1)
+        {
+            errhandle(dst_path, "fsetxattr", dst_name, FAIL_XATTR);
+        }
+    }
+}
+
+void transfer_xattr(struct dirh * src_dir, struct dirh * dst_dir, const char *src_name, const char *dst_name)
+{
+    int src_fd = wrap_open(src_path, src_dir, src_name, O_RDONLY, 0);
+    if ( src_fd < 0 )
+    {
+        goto fail_src_fd;
+    }
+    int dst_fd = wrap_open(dst_path, dst_dir, dst_name, O_RDONLY, 0);
+    if ( dst_fd < 0 )
+    {
+        goto fail_dst_fd;
+    }
+    transfer_xattr_fd(src_fd, dst_fd, src_name, dst_name);
+    close(dst_fd);
+fail_dst_fd:
+    close(src_fd);
+fail_src_fd:
+    ;
+}
+
+/*
+ * Directory metadata is applied post-order, once the whole subtree below
+ * the directory has been populated, through the directory handles that are
+ * still open at that point. Until then the destination directory stays
+ * writable for its owner, and the timestamps are not disturbed afterwards.
+ */
+void transfer_dirmeta(const struct stat * st, struct dirh * src_dir, struct dirh * dst_dir, const char *name)
+{
+    int dst_fd = ndirfd(dst_dir);
+    if ( dst_fd < 0 )
+    {
+        return;
+    }
+    if ( !opt_noxattr )
+    {
+        int src_fd = ndirfd(src_dir);
+        if ( src_fd >= 0 )
+        {
+            transfer_xattr_fd(src_fd, dst_fd, name, name);
+        }
+    }
+    if ( fchown(dst_fd, st->st_uid, st->st_gid) == -1 )
+    {
+        errhandle(dst_path, "chown", name, FAIL_CHOWN);
+    }
+    if ( fchmod(dst_fd, st->st_mode & 07777) == -1 )
+    {
+        errhandle(dst_path, "chmod", name, FAIL_CHMOD);
+    }
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    if ( futimens(dst_fd, times) == -1 )
+    {
+        errhandle(dst_path, "utimens", name, FAIL_CHMOD);
+    }
+}
+
+/* returns 0 and the content digest in *result once the whole file is copied */
+int copy_file(struct dirh * src_dir, struct dirh * dst_dir, const char *name, size_t size, mode_t mode, uint64_t *result)
+{
+    const size_t chunk = 1 << 20;
+    struct digest digest;
+    int ret = -1;
+    digest_init(&digest);
+    int dst_fd = wrap_creat(dst_path, dst_dir, name, mode);
+    if ( dst_fd == -1 )
+    {
+        return -1;
+    }
+    if ( size == 0 )
+    {
+        *result = digest_final(&digest);
+        ret = 0;
+    }
+    else
+    {
+        int src_fd = wrap_open(src_path, src_dir, name, O_RDONLY, FAIL_COPY);
+        if ( src_fd == -1 )
+        {
+            goto fail_src_fd;
+        }
+        void * src_map = wrap_mmap(src_path, size, src_fd, 0, name);
+        if ( src_map == MAP_FAILED )
+        {
+            goto fail_src_map;
+        }
+        size_t left = size;
+        char * p = src_map;
+        while ( left )
+        {
+            ssize_t readsize = write(dst_fd, p, left < chunk ? left : chunk);
+            if ( readsize <= 0 )
+            {
+                errhandle(dst_path, "write", name, FAIL_COPY);
+                break;
+            }
+            if ( digest_file )
+            {
+                digest_update(&digest, p, readsize);
+            }
+            left -= readsize;
+            p += readsize;
+        }
+        if ( !left )
+        {
+            *result = digest_final(&digest);
+            ret = 0;
+        }
+        munmap(src_map, size);
+fail_src_map:
+        close(src_fd);
+fail_src_fd:
+        ;
+    }
+    close(dst_fd);
+    return ret;
+}
+
+/*
+ * In static mode the replacements found in one directory are queued and
+ * carried out together, followed by a single directory fsync with -sync,
+ * instead of interleaving them with the content comparisons. Both files
+ * are stat'ed again right before the replacement, and an entry whose
+ * source or reference changed since it was compared is left alone.
+ */
+#define LINK_BATCH 64
+
+struct link_item
+{
+    char name[NAME_MAX + 1];
+    struct stat src_stat;
+    struct stat ref_stat;
+};
+
+struct link_batch
+{
+    int n;
+    struct link_item * items;
+};
+
+/*
+ * ctime is left out: the batch's own renames change the link count, and
+ * so the ctime, of files that have other names later in the batch
+ */
+static int same_file_state(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+void link_batch_flush(struct link_batch *b, struct dirh * ref_dir, struct dirh * dir)
+{
+    if ( !b->n )
+    {
+        return;
+    }
+    for ( int i = 0; i < b->n; ++i )
+    {
+        struct link_item * it = &b->items[i];
+        struct stat src_stat, ref_stat;
+        if ( wrap_stat(dir, it->name, &src_stat) || wrap_stat(ref_dir, it->name, &ref_stat)
+          || !same_file_state(&src_stat, &it->src_stat) || !same_file_state(&ref_stat, &it->ref_stat) )
+        {
+            debug("%s/%s changed since compared, not replaced\n", compath, it->name);
+            if (opt_verbose)
+            {
+                printf("KEEP %s/%s\n", compath, it->name);
+            }
+            continue;
+        }
+        wrap_replace(src_path, ref_dir, dir, it->name);
+    }
+    if ( opt_sync && fsync(ndirfd(dir)) == -1 )
+    {
+        errhandle(src_path, "fsync", ".", FAIL_HL);
+    }
+    b->n = 0;
+}
+
+void link_batch_add(struct link_batch *b, struct dirh * ref_dir, struct dirh * dir, const char *name,
+                    const struct stat *src_stat, const struct stat *ref_stat)
+{
+    if ( !b->items )
+    {
+        b->items = malloc(LINK_BATCH * sizeof(*b->items));
+    }
+    struct link_item * it = &b->items[b->n];
+    strcpy(it->name, name);
+    it->src_stat = *src_stat;
+    it->ref_stat = *ref_stat;
+    if ( ++b->n == LINK_BATCH )
+    {
+        link_batch_flush(b, ref_dir, dir);
+    }
+}
+
+void dive(struct dirh * src_dir, struct dirh * dst_dir, struct dirh * ref_dir)
+{
+    const char * name;
+    struct link_batch batch = { 0, NULL };
+    src_dir->iter = 1;
+    while ( fd_depth = src_dir->depth, (name = dirh_readdir(src_dir)) != NULL)
+    {
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        {
+            continue;
+        }
+        
+        struct stat src_stat[1];
+        struct stat ref_stat[1];
+        int src_stat_res;
+        int ref_stat_res;
+
+        src_stat_res = wrap_stat(src_dir, name, src_stat);
+        if ( src_stat_res )
+        {
+            continue;
+        }
+        PROGRESS_ADD(entries, 1);
+        PROGRESS_ADD(bytes, S_ISREG(src_stat->st_mode) ? src_stat->st_size : 0);
+        if ( ref_dir )
+        {
+            ref_stat_res = wrap_stat(ref_dir, name, ref_stat);
+        }
+        else
+        {
+            ref_stat_res = ENOENT;
+        }
+
+        if ( opt_debug )
+        {
+            debug_stat(src_stat_res, src_stat);
+            debug_stat(ref_stat_res, ref_stat);
+            debug(" %-40s %-40s", compath, name);
+        }
+
+        int diff = 0;
+        int hl = 0;
+        int dc;
+        int copied = 0;
+        uint64_t digest;
+
+        if ( !S_ISREG(src_stat->st_mode) )
+        {
+            debug(" noreg\n");
+            diff = 1;
+        }
+        else if ( ref_stat_res )
+        {
+            debug(" ref_stat_res\n");
+            diff = 1;
+        }
+        else if ( src_stat->st_uid != ref_stat->st_uid )
+        {
+            debug(" st_uid\n");
+            diff = 1;
+        }
+        else if ( src_stat->st_gid != ref_stat->st_gid )
+        {
+            debug(" st_gid\n");
+            diff = 1;
+        }
+        else if ( src_stat->st_mode != ref_stat->st_mode )
+        {
+            debug(" st_mode\n");
+            diff = 1;
+        }
+        else if ( src_stat->st_size != ref_stat->st_size )
+        {
+            debug(" st_size\n");
+            diff = 1;
+        }
+        else if ( src_stat->st_dev == ref_stat->st_dev && src_stat->st_ino == ref_stat->st_ino )
+        {
+            debug(" ===\n");
+            hl = 1;
+        }
+        else if (dc = diff_content(src_dir, ref_dir, name, ref_stat, dst_dir && digest_file ? &digest : NULL))
+        {
+            char sep = ' ';
+            if ( dc & 1 )
+            {
+                debug("%ccontent", sep);
+                sep = ',';
+            }
+            if ( dc & 2 )
+            {
+                debug("%cxattr_names", sep);
+                sep = ',';
+            }
+            if ( dc & 4 )
+            {
+                debug("%cxattr_values", sep);
+                sep = ',';
+            }
+            if ( dc & 8 )
+            {
+                debug("%cerror", sep);
+                sep = ',';
+            }
+            debug("\n");
+            diff = 1;
+        }
+        else
+        {
+            debug(" ==\n");
+        }
+
+        if (diff)
+        {
+            if (dst_dir)
+            {
+                if ( S_ISREG(src_stat->st_mode) )
+                {
+                    if (opt_verbose)
+                    {
+                        fprintf(stderr, "COPY %s/%s\n", compath, name);
+                    }
+                    copied = !copy_file(src_dir, dst_dir, name, src_stat->st_size, src_stat->st_mode, &digest);
+                }
+                else if ( S_ISLNK(src_stat->st_mode) )
+                {
+                    char lnk[PATH_MAX];
+                    if ( -1 != wrap_readlink(src_path, src_dir, name, lnk, sizeof(lnk)) )
+                    {
+                        wrap_symlink(dst_path, lnk, dst_dir, name);
+                    }
+                }
+                else if ( S_ISDIR(src_stat->st_mode) )
+                {
+                    wrap_mkdir_p(dst_path, dst_dir, name, (src_stat->st_mode & 07777) | S_IRWXU);
+                    struct dirh nx_src_h, nx_dst_h, nx_ref_h;
+                    struct dirh * nx_src_dir = wrap_opendir(src_path, &nx_src_h, src_dir, name);
+                    struct dirh * nx_dst_dir = wrap_opendir(dst_path, &nx_dst_h, dst_dir, name);
+                    struct dirh * nx_ref_dir = ref_dir ? wrap_opendir(0, &nx_ref_h, ref_dir, name) : NULL;
+                    if (nx_src_dir && nx_dst_dir)
+                    {
+                        int frame = compath_push(name);
+                        dive(nx_src_dir, nx_dst_dir, nx_ref_dir);
+                        compath_pop(frame);
+                        transfer_dirmeta(src_stat, nx_src_dir, nx_dst_dir, name);
+                    }
+                    if (nx_ref_dir)
+                    {
+                        dirh_close(nx_ref_dir);
+                    }
+                    if (nx_dst_dir)
+                    {
+                        dirh_close(nx_dst_dir);
+                    }
+                    if (nx_src_dir)
+                    {
+                        dirh_close(nx_src_dir);
+                    }
+                }
+                else
+                {
+                    wrap_mknod(dst_path, dst_dir, name, src_stat->st_mode, src_stat->st_rdev);
+                }
+                if ( !S_ISDIR(src_stat->st_mode) )
+                {
+                    transfer_owner(dst_path, src_stat, dst_dir, name);
+                    transfer_mode(dst_path, src_stat, dst_dir, name);
+                }
+                if ( !opt_noxattr && S_ISREG(src_stat->st_mode) )
+                {
+                    transfer_xattr(src_dir, dst_dir, name, name);
+                }
+                if ( copied )
+                {
+                    digest_record(dst_dir, name, digest);
+                }
+            }
+            else
+            {
+                if (S_ISDIR(src_stat->st_mode))
+                {
+                    struct dirh nx_src_h, nx_ref_h;
+                    struct dirh * nx_src_dir = wrap_opendir(src_path, &nx_src_h, src_dir, name);
+                    struct dirh * nx_ref_dir = ref_dir ? wrap_opendir(0, &nx_ref_h, ref_dir, name) : NULL;
+                    int frame = compath_push(name);
+                    dive(nx_src_dir, NULL, nx_ref_dir);
+                    compath_pop(frame);
+                    if (nx_ref_dir)
+                    {
+                        dirh_close(nx_ref_dir);
+                    }
+                    dirh_close(nx_src_dir);
+                }
+                else if (opt_verbose && S_ISREG(src_stat->st_mode))
+                {
+                    printf("KEEP %s/%s\n", compath, name);
+                }
+            }
+        }
+        else
+        {
+            if ( dst_dir )
+            {
+                if ( !wrap_link(dst_path, ref_dir, dst_dir, name) && !hl )
+                {
+                    digest_record(dst_dir, name, digest);
+                }
+            }
+            else
+            {
+                if ( ! hl )
+                {
+                    link_batch_add(&batch, ref_dir, src_dir, name, src_stat, ref_stat);
+                }
+            }
+        }
+    }
+    if (errno != 0)
+    {
+        fprintf(stderr, "ERROR: READDIR: {src}%s: %s\n", compath, strerror(errno));
+        exit(1);
+    }
+    link_batch_flush(&batch, ref_dir, src_dir);
+    free(batch.items);
+}
+
+/*
+ * -verify: walk <source> and <destination> side by side and check that
+ * the destination matches. Metadata is compared by the walking thread,
+ * content is digested by a pool of workers fed through a bounded queue.
+ * A destination file whose digest was recorded by the copying run is not
+ * read at all while its inode, size, mtime and ctime are as recorded, and files with several links are digested once per inode,
+ * so every byte of the source is read at most once.
+ */
+struct manifest_entry
+{
+    const char * path;
+    uint64_t digest;
+    ino_t ino;
+    off_t size;
+    struct timespec mtim;
+    struct timespec ctim;
+};
+
+struct manifest_entry * manifest = NULL;
+size_t manifest_n = 0;
+
+int manifest_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct manifest_entry *)a)->path, ((const struct manifest_entry *)b)->path);
+}
+
+void manifest_load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ( fd == -1 || fstat(fd, &st) )
+    {
+        errhandle("", "open", path, FAIL_MUST);
+        return;
+    }
+    char * buf = malloc(st.st_size + 1);
+    size_t got = 0;
+    while ( got < st.st_size )
+    {
+        ssize_t r = read(fd, buf + got, st.st_size - got);
+        if ( r <= 0 )
+        {
+            errhandle("", "read", path, FAIL_MUST);
+            break;
+        }
+        got += r;
+    }
+    close(fd);
+    buf[got] = 0;
+    size_t cap = 1024;
+    manifest = malloc(cap * sizeof(*manifest));
+    for ( char * p = buf; p < buf + got; p += strlen(p) + 1 )
+    {
+        unsigned long long digest, ino;
+        long long size, mtime, ctime;
+        long mtime_ns, ctime_ns;
+        int off = 0;
+        if ( sscanf(p, "%16llx %llu %lld %lld.%ld %lld.%ld %n", &digest, &ino, &size, &mtime, &mtime_ns, &ctime, &ctime_ns, &off) != 7 || !off )
+        {
+            continue;
+        }
+        if ( manifest_n == cap )
+        {
+            cap *= 2;
+            manifest = realloc(manifest, cap * sizeof(*manifest));
+        }
+        struct manifest_entry * e = &manifest[manifest_n++];
+        e->path = p + off;
+        e->digest = digest;
+        e->ino = ino;
+        e->size = size;
+        e->mtim.tv_sec = mtime;
+        e->mtim.tv_nsec = mtime_ns;
+        e->ctim.tv_sec = ctime;
+        e->ctim.tv_nsec = ctime_ns;
+    }
+    qsort(manifest, manifest_n, sizeof(*manifest), manifest_cmp);
+}
+
+struct manifest_entry * manifest_find(const char *name)
+{
+    char path[PATH_MAX];
+    if ( !manifest_n || snprintf(path, sizeof(path), "%s/%s", compath, name) >= sizeof(path) )
+    {
+        return NULL;
+    }
+    struct manifest_entry key = { .path = path };
+    return bsearch(&key, manifest, manifest_n, sizeof(*manifest), manifest_cmp);
+}
+
+/* a record only vouches for the destination file as it was when recorded */
+int manifest_current(const struct manifest_entry *e, const struct stat *st)
+{
+    return e->ino == st->st_ino && e->size == st->st_size
+        && e->mtim.tv_sec == st->st_mtim.tv_sec && e->mtim.tv_nsec == st->st_mtim.tv_nsec
+        && e->ctim.tv_sec == st->st_ctim.tv_sec && e->ctim.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+pthread_mutex_t audit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t audit_nonempty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t audit_nonfull = PTHREAD_COND_INITIALIZER;
+pthread_cond_t audit_published = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Digest of an inode with several links, shared by all jobs that see it.
+ * An entry leaves the table once all its links have been seen, and the
+ * table holds at most INODE_TAB_MAX entries. Links outside the tree (the
+ * destination's links to the reference) are never seen, so when the table
+ * is full, entries whose digest is published and that no job refers to are
+ * evicted; a later link of an evicted inode is simply digested again.
+ * Entries are freed when no job refers to them any more.
+ */
+#define INODE_TAB_BUCKETS 16384
+#define INODE_TAB_MAX 65536
+
+struct inode_digest
+{
+    dev_t dev;
+    ino_t ino;
+    nlink_t nlink_left;
+    int refs;
+    int dropped;
+    int done;
+    uint64_t digest;
+    struct inode_digest * next;
+};
+
+struct inode_digest * inode_tab[INODE_TAB_BUCKETS];
+size_t inode_tab_n = 0;
+size_t inode_tab_sweep_wait = 0;
+
+static size_t inode_hash(dev_t dev, ino_t ino)
+{
+    return (size_t)((ino ^ ((uint64_t)dev << 32)) * XXH_P1 >> 40) % INODE_TAB_BUCKETS;
+}
+
+void inode_release(struct inode_digest * e)
+{
+    if ( !e )
+    {
+        return;
+    }
+    pthread_mutex_lock(&audit_lock);
+    int gone = --e->refs == 0 && e->dropped;
+    pthread_mutex_unlock(&audit_lock);
+    if ( gone )
+    {
+        free(e);
+    }
+}
+
+/* returns the number of entries evicted; called by the walking thread only */
+static size_t inode_sweep(void)
+{
+    size_t n = 0;
+    pthread_mutex_lock(&audit_lock);
+    for ( size_t i = 0; i < INODE_TAB_BUCKETS; ++i )
+    {
+        struct inode_digest ** link = &inode_tab[i];
+        struct inode_digest * e;
+        while ( (e = *link) != NULL )
+        {
+            if ( e->done && e->refs == 0 )
+            {
+                *link = e->next;
+                free(e);
+                ++n;
+            }
+            else
+            {
+                link = &e->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&audit_lock);
+    inode_tab_n -= n;
+    return n;
+}
+
+/*
+ * returns the entry for st, *own set if the caller is the first to see it,
+ * or NULL if the table is full; called by the walking thread only
+ */
+struct inode_digest * inode_lookup(const struct stat *st, int *own)
+{
+    struct inode_digest ** link = &inode_tab[inode_hash(st->st_dev, st->st_ino)];
+    struct inode_digest * e;
+    for ( ; (e = *link) != NULL; link = &e->next )
+    {
+        if ( e->dev == st->st_dev && e->ino == st->st_ino )
+        {
+            break;
+        }
+    }
+    *own = 0;
+    if ( !e )
+    {
+        if ( inode_tab_n >= INODE_TAB_MAX )
+        {
+            /* after a sweep that found nothing, give the workers time to finish some */
+            if ( inode_tab_sweep_wait )
+            {
+                --inode_tab_sweep_wait;
+                return NULL;
+            }
+            if ( !inode_sweep() )
+            {
+                inode_tab_sweep_wait = INODE_TAB_MAX / 16;
+                return NULL;
+            }
+        }
+        e = calloc(1, sizeof(*e));
+        e->dev = st->st_dev;
+        e->ino = st->st_ino;
+        e->nlink_left = st->st_nlink;
+        e->next = inode_tab[inode_hash(st->st_dev, st->st_ino)];
+        inode_tab[inode_hash(st->st_dev, st->st_ino)] = e;
+        link = &inode_tab[inode_hash(st->st_dev, st->st_ino)];
+        ++inode_tab_n;
+        *own = 1;
+    }
+    pthread_mutex_lock(&audit_lock);
+    ++e->refs;
+    if ( --e->nlink_left == 0 )
+    {
+        *link = e->next;
+        --inode_tab_n;
+        e->dropped = 1;
+    }
+    pthread_mutex_unlock(&audit_lock);
+    return e;
+}
+
+struct audit_side
+{
+    int fd;
+    struct inode_digest * ino;
+    int own;
+};
+
+struct audit_job
+{
+    char * path;
+    off_t size;
+    struct audit_side side[2];
+    int have_expect;
+    uint64_t expect;
+};
+
+struct audit_job * audit_queue;
+int audit_qcap;
+int audit_qhead = 0;
+int audit_qlen = 0;
+int audit_closing = 0;
+int audit_diffs = 0;
+
+void audit_report(const char *path, const char *name, const char *what)
+{
+    pthread_mutex_lock(&audit_lock);
+    ++audit_diffs;
+    pthread_mutex_unlock(&audit_lock);
+    printf("DIFF %s%s%s: %s\n", path, name ? "/" : "", name ? name : "", what);
+}
+
+/* digest a whole file by reading it in chunks, -1 in *ok on error */
+uint64_t audit_digest_fd(int fd, off_t size, char *buf, size_t bufsize, int *ok)
+{
+    struct digest d;
+    digest_init(&d);
+    off_t total = 0;
+    ssize_t r;
+    while ( (r = read(fd, buf, bufsize)) > 0 )
+    {
+        digest_update(&d, buf, r);
+        total += r;
+    }
+    *ok = r == 0 && total == size;
+    return digest_final(&d);
+}
+
+uint64_t audit_side_digest(struct audit_side *side, off_t size, char *buf, size_t bufsize, int *ok)
+{
+    uint64_t digest;
+    *ok = 1;
+    if ( side->ino && !side->own )
+    {
+        pthread_mutex_lock(&audit_lock);
+        while ( !side->ino->done )
+        {
+            pthread_cond_wait(&audit_published, &audit_lock);
+        }
+        digest = side->ino->digest;
+        pthread_mutex_unlock(&audit_lock);
+        return digest;
+    }
+    digest = audit_digest_fd(side->fd, size, buf, bufsize, ok);
+    if ( side->ino )
+    {
+        pthread_mutex_lock(&audit_lock);
+        side->ino->digest = *ok ? digest : ~digest;
+        side->ino->done = 1;
+        pthread_cond_broadcast(&audit_published);
+        pthread_mutex_unlock(&audit_lock);
+    }
+    return digest;
+}
+
+void *audit_worker(void *arg)
+{
+    const size_t bufsize = 1 << 20;
+    char * buf = malloc(bufsize);
+    for (;;)
+    {
+        pthread_mutex_lock(&audit_lock);
+        while ( !audit_qlen && !audit_closing )
+        {
+            pthread_cond_wait(&audit_nonempty, &audit_lock);
+        }
+        if ( !audit_qlen )
+        {
+            pthread_mutex_unlock(&audit_lock);
+            break;
+        }
+        struct audit_job job = audit_queue[audit_qhead];
+        audit_qhead = (audit_qhead + 1) % audit_qcap;
+        --audit_qlen;
+        pthread_cond_signal(&audit_nonfull);
+        pthread_mutex_unlock(&audit_lock);
+
+        int src_ok, dst_ok = 1;
+        uint64_t src_digest = audit_side_digest(&job.side[0], job.size, buf, bufsize, &src_ok);
+        uint64_t dst_digest = job.have_expect ? job.expect : audit_side_digest(&job.side[1], job.size, buf, bufsize, &dst_ok);
+        if ( !src_ok || !dst_ok )
+        {
+            audit_report(job.path, NULL, "read");
+        }
+        else if ( src_digest != dst_digest )
+        {
+            audit_report(job.path, NULL, "content");
+        }
+        for ( int i = 0; i < 2; ++i )
+        {
+            if ( job.side[i].fd != -1 )
+            {
+                close(job.side[i].fd);
+            }
+            inode_release(job.side[i].ino);
+        }
+        free(job.path);
+    }
+    free(buf);
+    return NULL;
+}
+
+void audit_push(struct audit_job *job)
+{
+    pthread_mutex_lock(&audit_lock);
+    while ( audit_qlen == audit_qcap )
+    {
+        pthread_cond_wait(&audit_nonfull, &audit_lock);
+    }
+    audit_queue[(audit_qhead + audit_qlen) % audit_qcap] = *job;
+    ++audit_qlen;
+    pthread_cond_signal(&audit_nonempty);
+    pthread_mutex_unlock(&audit_lock);
+}
+
+void audit_file(struct dirh * src_dir, struct dirh * dst_dir, const char *name, const struct stat *src_stat, const struct stat *dst_stat)
+{
+    struct audit_job job;
+    memset(&job, 0, sizeof(job));
+    job.side[0].fd = job.side[1].fd = -1;
+    if ( src_stat->st_dev == dst_stat->st_dev && src_stat->st_ino == dst_stat->st_ino )
+    {
+        return;
+    }
+    struct manifest_entry * rec = manifest_find(name);
+    if ( rec && !manifest_current(rec, dst_stat) )
+    {
+        debug("verify: %s/%s changed since recorded\n", compath, name);
+        rec = NULL;
+    }
+    int need_dst = !rec;
+    if ( src_stat->st_nlink > 1 )
+    {
+        job.side[0].ino = inode_lookup(src_stat, &job.side[0].own);
+    }
+    if ( need_dst && dst_stat->st_nlink > 1 )
+    {
+        job.side[1].ino = inode_lookup(dst_stat, &job.side[1].own);
+    }
+    int need_src_fd = !job.side[0].ino || job.side[0].own;
+    int need_dst_fd = need_dst && (!job.side[1].ino || job.side[1].own);
+    if ( need_src_fd || !opt_noxattr )
+    {
+        job.side[0].fd = wrap_open(src_path, src_dir, name, O_RDONLY, FAIL_DIFF);
+    }
+    if ( need_dst_fd || !opt_noxattr )
+    {
+        job.side[1].fd = wrap_open(dst_path, dst_dir, name, O_RDONLY, FAIL_DIFF);
+    }
+    if ( !opt_noxattr && job.side[0].fd != -1 && job.side[1].fd != -1 && diff_xattr(src_path, job.side[0].fd, dst_path, job.side[1].fd) )
+    {
+        audit_report(compath, name, "xattr");
+    }
+    if ( !need_src_fd && job.side[0].fd != -1 )
+    {
+        close(job.side[0].fd);
+        job.side[0].fd = -1;
+    }
+    if ( !need_dst_fd && job.side[1].fd != -1 )
+    {
+        close(job.side[1].fd);
+        job.side[1].fd = -1;
+    }
+    if ( (need_src_fd && job.side[0].fd == -1) || (need_dst_fd && job.side[1].fd == -1) )
+    {
+        /* publish something so that later links of the inode do not wait forever */
+        pthread_mutex_lock(&audit_lock);
+        for ( int i = 0; i < 2; ++i )
+        {
+            if ( job.side[i].own )
+            {
+                job.side[i].ino->digest = i;
+                job.side[i].ino->done = 1;
+            }
+            if ( job.side[i].fd != -1 )
+            {
+                close(job.side[i].fd);
+            }
+        }
+        pthread_cond_broadcast(&audit_published);
+        pthread_mutex_unlock(&audit_lock);
+        inode_release(job.side[0].ino);
+        inode_release(job.side[1].ino);
+        audit_report(compath, name, "open");
+        return;
+    }
+    job.size = src_stat->st_size;
+    job.have_expect = rec != NULL;
+    job.expect = rec ? rec->digest : 0;
+    job.path = malloc(compath_i + strlen(name) + 2);
+    sprintf(job.path, "%s/%s", compath, name);
+    audit_push(&job);
+}
+
+void audit(struct dirh * src_dir, struct dirh * dst_dir)
+{
+    const char * name;
+    int n_src = 0;
+    src_dir->iter = 1;
+    while ( fd_depth = src_dir->depth, (name = dirh_readdir(src_dir)) != NULL)
+    {
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        {
+            continue;
+        }
+        struct stat src_stat[1];
+        struct stat dst_stat[1];
+        if ( wrap_stat(src_dir, name, src_stat) )
+        {
+            continue;
+        }
+        ++n_src;
+        PROGRESS_ADD(entries, 1);
+        PROGRESS_ADD(bytes, S_ISREG(src_stat->st_mode) ? src_stat->st_size : 0);
+        if ( wrap_stat(dst_dir, name, dst_stat) )
+        {
+            audit_report(compath, name, "missing");
+            continue;
+        }
+        if ( (src_stat->st_mode & S_IFMT) != (dst_stat->st_mode & S_IFMT) )
+        {
+            audit_report(compath, name, "type");
+            continue;
+        }
+        if ( src_stat->st_uid != dst_stat->st_uid || src_stat->st_gid != dst_stat->st_gid )
+        {
+            audit_report(compath, name, "owner");
+        }
+        if ( !S_ISLNK(src_stat->st_mode) && src_stat->st_mode != dst_stat->st_mode )
+        {
+            audit_report(compath, name, "mode");
+        }
+        if ( S_ISREG(src_stat->st_mode) )
+        {
+            if ( src_stat->st_size != dst_stat->st_size )
+            {
+                audit_report(compath, name, "size");
+            }
+            else
+            {
+                audit_file(src_dir, dst_dir, name, src_stat, dst_stat);
+            }
         }
-        else if ( src_stat->st_dev == ref_stat->st_dev && src_stat->st_ino == ref_stat->st_ino )
+        else if ( S_ISLNK(src_stat->st_mode) )
         {
-            debug(" ===\n");
-            hl = 1;
+            char src_lnk[PATH_MAX];
+            char dst_lnk[PATH_MAX];
+            if ( -1 == wrap_readlink(src_path, src_dir, name, src_lnk, sizeof(src_lnk))
+              || -1 == wrap_readlink(dst_path, dst_dir, name, dst_lnk, sizeof(dst_lnk))
+              || strcmp(src_lnk, dst_lnk) )
+            {
+                audit_report(compath, name, "symlink");
+            }
         }
-        else if (dc = diff_content(src_dir, ref_dir, name, src_stat->st_size))
+        else if ( S_ISDIR(src_stat->st_mode) )
         {
-            char sep = ' ';
-            if ( dc & 1 )
+            struct dirh nx_src_h, nx_dst_h;
+            struct dirh * nx_src_dir = wrap_opendir(src_path, &nx_src_h, src_dir, name);
+            struct dirh * nx_dst_dir = wrap_opendir(dst_path, &nx_dst_h, dst_dir, name);
+            if (nx_src_dir && nx_dst_dir)
             {
-                debug("%ccontent", sep);
-                sep = ',';
+                if ( !opt_noxattr && diff_xattr(src_path, ndirfd(nx_src_dir), dst_path, ndirfd(nx_dst_dir)) )
+                {
+                    audit_report(compath, name, "xattr");
+                }
+                int frame = compath_push(name);
+                audit(nx_src_dir, nx_dst_dir);
+                compath_pop(frame);
             }
-            if ( dc & 2 )
+            else
             {
-                debug("%cxattr_names", sep);
-                sep = ',';
+                audit_report(compath, name, "opendir");
             }
-            if ( dc & 4 )
+            if (nx_dst_dir)
             {
-                debug("%cxattr_values", sep);
-                sep = ',';
+                dirh_close(nx_dst_dir);
             }
-            if ( dc & 8 )
+            if (nx_src_dir)
             {
-                debug("%cerror", sep);
-                sep = ',';
+                dirh_close(nx_src_dir);
             }
-            debug("\n");
-            diff = 1;
         }
-        else
+        else if ( src_stat->st_rdev != dst_stat->st_rdev )
         {
-            debug(" ==\n");
+            audit_report(compath, name, "rdev");
         }
+    }
+    if (errno != 0)
+    {
+        fprintf(stderr, "ERROR: READDIR: {src}%s: %s\n", compath, strerror(errno));
+        exit(1);
+    }
 
-        if (diff)
+    /* entries present only in destination */
+    int n_dst = 0;
+    fd_depth = dst_dir->depth;
+    dst_dir->iter = 1;
+    while ( (name = dirh_readdir(dst_dir)) != NULL )
+    {
+        n_dst += strcmp(name, ".") && strcmp(name, "..");
+    }
+    if ( n_dst != n_src )
+    {
+        audit_report(compath[0] ? compath : "/", NULL, "extra entries");
+    }
+}
+
+/*
+ * -progress: a separate thread waits for SIGUSR1 (through a signalfd) and
+ * for connections on the optional unix socket, and answers each with one
+ * line built from the walker's counters. Unless -total is given, another
+ * thread counts the entries of the tree being walked, for the ETA.
+ */
+const char * opt_progress = NULL;
+uint64_t progress_total = 0;
+int progress_total_known = 0;
+const char * progress_root;
+int progress_sigfd = -1;
+int progress_sockfd = -1;
+struct stat progress_sock_stat;
+double progress_start;
+double progress_last_time;
+struct progress progress_last;
+pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void progress_count(int root_fd, char *path, size_t len)
+{
+    int fd = openat(root_fd, len ? path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if ( fd == -1 )
+    {
+        return;
+    }
+    DIR * dir = fdopendir(fd);
+    if ( !dir )
+    {
+        close(fd);
+        return;
+    }
+    char * subdirs = NULL;
+    size_t subdirs_len = 0;
+    size_t subdirs_cap = 0;
+    uint64_t n = 0;
+    struct dirent *dent;
+    while ( (dent = readdir(dir)) != NULL )
+    {
+        const char * name = dent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
         {
-            if (dst_dir)
-            {
-                if ( S_ISREG(src_stat->st_mode) )
-                {
-                    if (opt_verbose)
-                    {
-                        fprintf(stderr, "COPY %s/%s\n", compath, name);
-                    }
-                    copy_file(src_dir, dst_dir, name, src_stat->st_size, src_stat->st_mode);
-                }
-                else if ( S_ISLNK(src_stat->st_mode) )
-                {
-                    char lnk[PATH_MAX];
-                    if ( -1 != wrap_readlink(src_path, src_dir, name, lnk, sizeof(lnk)) )
-                    {
-                        wrap_symlink(dst_path, lnk, dst_dir, name);
-                    }
-                }
-                else if ( S_ISDIR(src_stat->st_mode) )
-                {
-                    wrap_mkdir_p(dst_path, dst_dir, name, src_stat->st_mode & 07777);
-                    DIR * nx_src_dir = wrap_opendir(src_path, src_dir, name);
-                    DIR * nx_dst_dir = wrap_opendir(dst_path, dst_dir, name);
-                    DIR * nx_ref_dir = ref_dir ? wrap_opendir(0, ref_dir, name) : NULL;
-                    int frame = compath_push(name);
-                    dive(nx_src_dir, nx_dst_dir, nx_ref_dir);
-                    compath_pop(frame);
-                    if (nx_ref_dir)
-                    {
-                        closedir(nx_ref_dir);
-                    }
-                    closedir(nx_dst_dir);
-                    closedir(nx_src_dir);
-                }
-                else
-                {
-                    wrap_mknod(dst_path, dst_dir, name, src_stat->st_mode, src_stat->st_rdev);
-                }
-                transfer_owner(dst_path, src_stat, dst_dir, name);
-                transfer_mode(dst_path, src_stat, dst_dir, name);
-                if ( !opt_noxattr && (S_ISREG(src_stat->st_mode) || S_ISDIR(src_stat->st_mode) ) )
-                {
-                    transfer_xattr(src_dir, dst_dir, name, name);
-                }
-            }
-            else
+            continue;
+        }
+        ++n;
+        int is_dir = dent->d_type == DT_DIR;
+        if ( dent->d_type == DT_UNKNOWN )
+        {
+            struct stat st;
+            is_dir = !fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+        }
+        if ( is_dir )
+        {
+            size_t l = strlen(name) + 1;
+            if ( subdirs_len + l > subdirs_cap )
             {
-                if (S_ISDIR(src_stat->st_mode))
-                {
-                    DIR * nx_src_dir = wrap_opendir(src_path, src_dir, name);
-                    DIR * nx_ref_dir = ref_dir ? wrap_opendir(0, ref_dir, name) : NULL;
-                    int frame = compath_push(name);
-                    dive(nx_src_dir, NULL, nx_ref_dir);
-                    compath_pop(frame);
-                    if (nx_ref_dir)
-                    {
-                        closedir(nx_ref_dir);
-                    }
-                    closedir(nx_src_dir);
-                }
-                else if (opt_verbose && S_ISREG(src_stat->st_mode))
-                {
-                    printf("KEEP %s/%s\n", compath, name);
-                }
+                subdirs_cap = subdirs_cap ? subdirs_cap * 2 : 4096;
+                subdirs = realloc(subdirs, subdirs_cap);
             }
+            memcpy(subdirs + subdirs_len, name, l);
+            subdirs_len += l;
         }
-        else
+    }
+    closedir(dir);
+    __atomic_add_fetch(&progress_total, n, __ATOMIC_RELAXED);
+    for ( size_t off = 0; off < subdirs_len; off += strlen(subdirs + off) + 1 )
+    {
+        int l = snprintf(path + len, PATH_MAX - len, "%s%s", len ? "/" : "", subdirs + off);
+        if ( len + l < PATH_MAX )
         {
-            if ( dst_dir )
+            progress_count(root_fd, path, len + l);
+        }
+        path[len] = 0;
+    }
+    free(subdirs);
+}
+
+void *progress_counter(void *arg)
+{
+    char path[PATH_MAX] = "";
+    int root_fd = open(progress_root, O_RDONLY | O_DIRECTORY);
+    if ( root_fd != -1 )
+    {
+        progress_count(root_fd, path, 0);
+        close(root_fd);
+    }
+    __atomic_store_n(&progress_total_known, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void progress_duration(char *buf, size_t len, double sec)
+{
+    long s = sec;
+    snprintf(buf, len, "%ldh%02ldm%02lds", s / 3600, s / 60 % 60, s % 60);
+}
+
+int progress_format(char *buf, size_t len)
+{
+    struct progress cur;
+    cur.entries = __atomic_load_n(&progress_walk.entries, __ATOMIC_RELAXED);
+    cur.bytes = __atomic_load_n(&progress_walk.bytes, __ATOMIC_RELAXED);
+    uint64_t total = __atomic_load_n(&progress_total, __ATOMIC_RELAXED);
+    int known = __atomic_load_n(&progress_total_known, __ATOMIC_ACQUIRE);
+    char path[PATH_MAX];
+    progress_path_read(path, sizeof(path));
+
+    /* the final report at exit may run while the progress thread answers */
+    pthread_mutex_lock(&progress_lock);
+    double now = now_ns() / 1e9;
+    double elapsed = now - progress_start;
+    double span = now - progress_last_time;
+    double rate = elapsed > 0 ? cur.entries / elapsed : 0;
+    double now_rate = span > 0 ? (cur.entries - progress_last.entries) / span : 0;
+    double now_bytes = span > 0 ? (cur.bytes - progress_last.bytes) / span : 0;
+    progress_last = cur;
+    progress_last_time = now;
+    pthread_mutex_unlock(&progress_lock);
+
+    char elapsed_str[32];
+    char eta_str[32] = "?";
+    progress_duration(elapsed_str, sizeof(elapsed_str), elapsed);
+    if ( known && rate > 0 )
+    {
+        progress_duration(eta_str, sizeof(eta_str), total > cur.entries ? (total - cur.entries) / rate : 0);
+    }
+    return snprintf(buf, len,
+        "PROGRESS entries %llu/%llu%s bytes %llu elapsed %s rate %.0f/s now %.0f/s %.1f MB/s eta %s path %s\n",
+        (unsigned long long)cur.entries, (unsigned long long)total, known ? "" : "+",
+        (unsigned long long)cur.bytes, elapsed_str, rate, now_rate, now_bytes / 1e6, eta_str,
+        path[0] ? path : "/");
+}
+
+void *progress_thread(void *arg)
+{
+    struct pollfd fds[2] = { { progress_sigfd, POLLIN, 0 }, { progress_sockfd, POLLIN, 0 } };
+    int nfds = progress_sockfd == -1 ? 1 : 2;
+    char buf[PATH_MAX + 256];
+    for (;;)
+    {
+        if ( poll(fds, nfds, -1) == -1 )
+        {
+            continue;
+        }
+        if ( fds[0].revents & POLLIN )
+        {
+            struct signalfd_siginfo si;
+            if ( read(progress_sigfd, &si, sizeof(si)) == sizeof(si) )
             {
-                wrap_link(dst_path, ref_dir, dst_dir, name);
+                int n = progress_format(buf, sizeof(buf));
+                fwrite(buf, 1, n < sizeof(buf) ? n : sizeof(buf) - 1, stderr);
             }
-            else
+        }
+        if ( nfds > 1 && (fds[1].revents & POLLIN) )
+        {
+            int client = accept4(progress_sockfd, NULL, NULL, SOCK_CLOEXEC);
+            if ( client != -1 )
             {
-                if ( ! hl )
+                /* a client that hangs up or never reads must not affect the run */
+                struct timeval timeout = { 1, 0 };
+                setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                int n = progress_format(buf, sizeof(buf));
+                if ( send(client, buf, n < sizeof(buf) ? n : sizeof(buf) - 1, MSG_NOSIGNAL) == -1 )
                 {
-                    wrap_remove(src_path, src_dir, name);
-                    wrap_link(src_path, ref_dir, src_dir, name);
+                    debug("progress: send: %m\n");
                 }
+                close(client);
             }
         }
     }
-    if (errno != 0)
+    return NULL;
+}
+
+void progress_exit()
+{
+    char buf[PATH_MAX + 256];
+    int n = progress_format(buf, sizeof(buf));
+    fwrite(buf, 1, n < sizeof(buf) ? n : sizeof(buf) - 1, stderr);
+    struct stat st;
+    if ( progress_sockfd != -1 && !lstat(opt_progress, &st) && S_ISSOCK(st.st_mode)
+      && st.st_dev == progress_sock_stat.st_dev && st.st_ino == progress_sock_stat.st_ino )
     {
-        fprintf(stderr, "ERROR: READDIR: {src}%s: %s\n", compath, strerror(errno));
-        exit(1);
+        unlink(opt_progress);
+    }
+}
+
+/* must run before any other thread is created, so that all of them block SIGUSR1 */
+void progress_init(const char *root)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    progress_sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if ( progress_sigfd == -1 )
+    {
+        errhandle("", "signalfd", "SIGUSR1", FAIL_MUST);
+    }
+    if ( *opt_progress )
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if ( strlen(opt_progress) >= sizeof(addr.sun_path) )
+        {
+            errno = ENAMETOOLONG;
+            errhandle("", "socket", opt_progress, FAIL_MUST);
+        }
+        strcpy(addr.sun_path, opt_progress);
+        /* a stale socket of an earlier run is replaced, anything else is left alone */
+        struct stat st;
+        if ( !lstat(opt_progress, &st) && S_ISSOCK(st.st_mode) )
+        {
+            unlink(opt_progress);
+        }
+        progress_sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if ( progress_sockfd == -1
+          || bind(progress_sockfd, (struct sockaddr *)&addr, sizeof(addr))
+          || listen(progress_sockfd, 4)
+          || lstat(opt_progress, &progress_sock_stat) )
+        {
+            errhandle("", "socket", opt_progress, FAIL_MUST);
+        }
+    }
+    progress_start = progress_last_time = now_ns() / 1e9;
+    progress_root = root;
+    pthread_t thread;
+    if ( !progress_total_known )
+    {
+        pthread_create(&thread, NULL, progress_counter, NULL);
+        pthread_detach(thread);
     }
+    pthread_create(&thread, NULL, progress_thread, NULL);
+    pthread_detach(thread);
+    atexit(progress_exit);
 }
 
 int main(int argc, char *argv[])
@@ -700,6 +2673,18 @@ int main(int argc, char *argv[])
 
     const char *fail_str = "fail=";
     const int fail_len = strlen(fail_str);
+    const char *fdmax_str = "fdmax=";
+    const int fdmax_len = strlen(fdmax_str);
+    const char *digest_str = "digest=";
+    const int digest_len = strlen(digest_str);
+    const char *jobs_str = "jobs=";
+    const int jobs_len = strlen(jobs_str);
+    const char *refcache_str = "refcache=";
+    const int refcache_len = strlen(refcache_str);
+    const char *progress_str = "progress";
+    const int progress_len = strlen(progress_str);
+    const char *total_str = "total=";
+    const int total_len = strlen(total_str);
     for ( int i = 1; i < argc; ++i )
     {
         char *arg = argv[i];
@@ -709,6 +2694,9 @@ int main(int argc, char *argv[])
             opt_off      |=! strcmp(arg, "-");
             opt_noxattr  |=! strcmp(arg, "noxattr");
             opt_static   |=! strcmp(arg, "static");
+            opt_verify   |=! strcmp(arg, "verify");
+            opt_snapshot |=! strcmp(arg, "snapshot");
+            opt_sync     |=! strcmp(arg, "sync");
             opt_debug    |=! strcmp(arg, "debug");
             opt_verbose  |=! strcmp(arg, "verbose");
             opt_help     |=! strcmp(arg, "help");
@@ -719,6 +2707,33 @@ int main(int argc, char *argv[])
                 opt_fail = 0;
                 sscanf(arg + fail_len, "%i", &opt_fail);
             }
+            if (!memcmp(arg, fdmax_str, fdmax_len))
+            {
+                sscanf(arg + fdmax_len, "%i", &fd_max);
+            }
+            if (!memcmp(arg, digest_str, digest_len))
+            {
+                opt_digest = arg + digest_len;
+            }
+            if (!memcmp(arg, jobs_str, jobs_len))
+            {
+                sscanf(arg + jobs_len, "%i", &opt_jobs);
+            }
+            if (!memcmp(arg, refcache_str, refcache_len))
+            {
+                opt_refcache = arg + refcache_len;
+            }
+            if (!memcmp(arg, progress_str, progress_len) && (!arg[progress_len] || arg[progress_len] == '='))
+            {
+                opt_progress = arg + progress_len + !!arg[progress_len];
+            }
+            if (!memcmp(arg, total_str, total_len))
+            {
+                unsigned long long total = 0;
+                sscanf(arg + total_len, "%llu", &total);
+                progress_total = total;
+                progress_total_known = 1;
+            }
         }
         else if ( n_posarg < n_posarg_max )
         {
@@ -727,6 +2742,52 @@ int main(int argc, char *argv[])
     }
     opt_fail |= FAIL_MUST;
 
+    if (opt_jobs <= 0)
+    {
+        opt_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (opt_jobs <= 0)
+        {
+            opt_jobs = 1;
+        }
+    }
+
+    struct rlimit rl;
+    int fd_limit = 1024;
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < INT_MAX)
+    {
+        fd_limit = rl.rlim_cur;
+    }
+    fd_limit -= fd_reserve;
+    if (opt_verify)
+    {
+        /*
+         * every queued or running job holds up to two file descriptors;
+         * they may take at most half of the limit, the rest is for directories
+         */
+        if (opt_jobs > fd_limit / 8)
+        {
+            opt_jobs = fd_limit / 8 > 0 ? fd_limit / 8 : 1;
+        }
+        audit_qcap = 4 * opt_jobs;
+        if (audit_qcap > fd_limit / 4 - opt_jobs)
+        {
+            audit_qcap = fd_limit / 4 - opt_jobs;
+        }
+        if (audit_qcap < 1)
+        {
+            audit_qcap = 1;
+        }
+        fd_limit -= 2 * (audit_qcap + opt_jobs);
+    }
+    if (fd_max <= 0)
+    {
+        fd_max = fd_limit;
+    }
+    if (fd_max < 1)
+    {
+        fd_max = 1;
+    }
+
     if (opt_help)
     {
         usage();
@@ -743,7 +2804,90 @@ int main(int argc, char *argv[])
         xattr_value_buf[1] = malloc(xattr_max);
     }
 
-    if (opt_static)
+    if (opt_progress && n_posarg > 0)
+    {
+        progress_init(posarg[0]);
+    }
+
+    if (opt_snapshot)
+    {
+        if ( n_posarg != 2 )
+        {
+            usage();
+            exit(1);
+        }
+        ref_path = posarg[0];
+        struct stat ref_stat;
+        if (wrap_stat(NULL, ref_path, &ref_stat))
+        {
+            fprintf(stderr, "%s does not exist\n", ref_path);
+            exit(3);
+        }
+        struct dirh ref_h;
+        struct dirh * ref_root = wrap_opendir_root(&ref_h, ref_path);
+        /* identify the root the way -refcache does, through the opened directory */
+        if (!ref_root || fstat(ndirfd(ref_root), &ref_stat))
+        {
+            errhandle("", "stat", ref_path, FAIL_MUST);
+        }
+        snapshot_walk(ref_root);
+        snapshot_write(posarg[1], &ref_stat);
+    }
+    else if (opt_verify)
+    {
+        if ( n_posarg != 2 )
+        {
+            usage();
+            exit(1);
+        }
+        src_path = posarg[0];
+        dst_path = posarg[1];
+        if (opt_digest)
+        {
+            manifest_load(opt_digest);
+        }
+
+        struct stat src_stat, dst_stat;
+        if (wrap_stat(NULL, src_path, &src_stat) || wrap_stat(NULL, dst_path, &dst_stat))
+        {
+            fprintf(stderr, "%s or %s does not exist\n", src_path, dst_path);
+            exit(3);
+        }
+        if (src_stat.st_uid != dst_stat.st_uid || src_stat.st_gid != dst_stat.st_gid)
+        {
+            audit_report("/", NULL, "owner");
+        }
+        if (src_stat.st_mode != dst_stat.st_mode)
+        {
+            audit_report("/", NULL, "mode");
+        }
+
+        struct dirh src_h, dst_h;
+        struct dirh * src_root = wrap_opendir_root(&src_h, src_path);
+        struct dirh * dst_root = wrap_opendir_root(&dst_h, dst_path);
+
+        audit_queue = malloc(audit_qcap * sizeof(*audit_queue));
+        pthread_t workers[opt_jobs];
+        for ( int i = 0; i < opt_jobs; ++i )
+        {
+            pthread_create(&workers[i], NULL, audit_worker, NULL);
+        }
+        audit(src_root, dst_root);
+        pthread_mutex_lock(&audit_lock);
+        audit_closing = 1;
+        pthread_cond_broadcast(&audit_nonempty);
+        pthread_mutex_unlock(&audit_lock);
+        for ( int i = 0; i < opt_jobs; ++i )
+        {
+            pthread_join(workers[i], NULL);
+        }
+        if (audit_diffs)
+        {
+            fprintf(stderr, "%d differences\n", audit_diffs);
+            exit(2);
+        }
+    }
+    else if (opt_static)
     {
         if ( n_posarg != 2 )
         {
@@ -752,18 +2896,31 @@ int main(int argc, char *argv[])
         }
         src_path = posarg[0];
         ref_path = posarg[1];
-        DIR * src_root = wrap_opendir_root(src_path);
-        DIR * ref_root;
+        struct dirh src_h, ref_h;
+        struct dirh * src_root = wrap_opendir_root(&src_h, src_path);
+        struct dirh * ref_root;
         if (access(ref_path, X_OK))
         {
             ref_root = NULL;
         }
         else
         {
-            ref_root = wrap_opendir_root(ref_path);
+            ref_root = wrap_opendir_root(&ref_h, ref_path);
+        }
+        if (ref_root && opt_refcache)
+        {
+            struct stat ref_stat;
+            if (!fstat(ndirfd(ref_root), &ref_stat))
+            {
+                snapshot_load(opt_refcache, &ref_stat);
+            }
         }
 
         dive(src_root, NULL, ref_root);
+        if (opt_verbose)
+        {
+            cmp_stats();
+        }
     }
     else
     {
@@ -788,17 +2945,12 @@ int main(int argc, char *argv[])
             fprintf(stderr, "%s does not exist\n", src_path);
             exit(3);
         }
-        mkdir(dst_path, src_stat.st_mode);
-        transfer_owner(dst_path, &src_stat, NULL, dst_path);
-        transfer_mode(dst_path, &src_stat, NULL, dst_path);
-        if (!opt_noxattr)
-        {
-            transfer_xattr(NULL, NULL, src_path, dst_path);
-        }
+        mkdir(dst_path, src_stat.st_mode | S_IRWXU);
 
-        DIR * src_root = wrap_opendir_root(src_path);
-        DIR * dst_root = wrap_opendir_root(dst_path);
-        DIR * ref_root;
+        struct dirh src_h, dst_h, ref_h;
+        struct dirh * src_root = wrap_opendir_root(&src_h, src_path);
+        struct dirh * dst_root = wrap_opendir_root(&dst_h, dst_path);
+        struct dirh * ref_root;
 
         if (access(ref_path, X_OK))
         {
@@ -806,10 +2958,37 @@ int main(int argc, char *argv[])
         }
         else
         {
-            ref_root = wrap_opendir_root(ref_path);
+            ref_root = wrap_opendir_root(&ref_h, ref_path);
+        }
+        if (ref_root && opt_refcache)
+        {
+            struct stat ref_stat;
+            if (!fstat(ndirfd(ref_root), &ref_stat))
+            {
+                snapshot_load(opt_refcache, &ref_stat);
+            }
+        }
+
+        if (opt_digest)
+        {
+            digest_file = fopen(opt_digest, "w");
+            if (!digest_file)
+            {
+                errhandle("", "open", opt_digest, FAIL_MUST);
+            }
         }
 
         dive(src_root, dst_root, ref_root);
+        transfer_dirmeta(&src_stat, src_root, dst_root, dst_path);
+        if (opt_verbose)
+        {
+            cmp_stats();
+        }
+
+        if (digest_file && fclose(digest_file))
+        {
+            errhandle("", "write", opt_digest, FAIL_MUST);
+        }
     }
 
 